@@ -18,10 +18,12 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 
 #include "mongo/pch.h"
 
+#include <algorithm>
 #include <string>
 
 #include <backup.h>
 
+#include "history.h"
 #include "manager.h"
 
 #include "mongo/base/status.h"
@@ -64,7 +66,9 @@ namespace mongo {
             }
             virtual void help(stringstream &h) const {
                 h << "Starts a hot backup." << endl
-                  << "{ backupStart: <destination directory> }";
+                  << "{ backupStart: <destination directory>, dryRun: <bool> }" << endl
+                  << "With dryRun, nothing is copied; instead reports the backup size, free space" << endl
+                  << "at the destination, measured throughput and the expected duration.";
             }
             virtual bool run(const string &db, BSONObj &cmdObj, int options, string &errmsg, BSONObjBuilder &result, bool fromRepl) {
                 BSONElement e = cmdObj.firstElement();
@@ -74,6 +78,9 @@ namespace mongo {
                     return false;
                 }
                 Manager manager(cc());
+                if (cmdObj["dryRun"].trueValue()) {
+                    return manager.dryRun(dest, errmsg, result);
+                }
                 return manager.start(dest, errmsg, result);
             }
         };
@@ -91,7 +98,8 @@ namespace mongo {
             virtual void help(stringstream &h) const {
                 h << "Throttles hot backup to consume only N bytes/sec of I/O." << endl
                   << "{ backupThrottle: <N> }" << endl
-                  << "N can be an integer or a string with a \"k/m/g\" suffix";
+                  << "N can be an integer or a string with a \"k/m/g\" suffix" << endl
+                  << "Loading the plugin removes any throttle.";
             }
             virtual bool run(const string &db, BSONObj &cmdObj, int options, string &errmsg, BSONObjBuilder &result, bool fromRepl) {
                 BSONElement e = cmdObj.firstElement();
@@ -135,6 +143,44 @@ namespace mongo {
             }
         };
 
+        class BackupHistoryCommand : public BackupCommand {
+          public:
+            BackupHistoryCommand() : BackupCommand("backupHistory") {}
+            virtual void addRequiredPrivileges(const std::string& dbname,
+                                               const BSONObj& cmdObj,
+                                               std::vector<Privilege>* out) {
+                ActionSet actions;
+                actions.addAction(ActionType::backupStatus);
+                out->push_back(Privilege(AuthorizationManager::SERVER_RESOURCE_NAME, actions));
+            }
+            virtual void help(stringstream &h) const {
+                h << "Report summaries of recent hot backups, newest first." << endl
+                  << "{ backupHistory: 1, limit: <N> }" << endl
+                  << "N limits the number of backups reported, 0 or no limit means all that are kept.";
+            }
+            virtual bool run(const string &db, BSONObj &cmdObj, int options, string &errmsg, BSONObjBuilder &result, bool fromRepl) {
+                int limit = 0;
+                BSONElement e = cmdObj["limit"];
+                if (!e.eoo()) {
+                    if (!e.isNumber()) {
+                        errmsg = "backupHistory limit must be a number";
+                        return false;
+                    }
+                    long long n = e.safeNumberLong();
+                    if (e.numberDouble() != static_cast<double>(n)) {
+                        errmsg = "backupHistory limit must be an integer";
+                        return false;
+                    }
+                    if (n < 0) {
+                        errmsg = "backupHistory limit cannot be negative";
+                        return false;
+                    }
+                    limit = static_cast<int>(std::min(n, static_cast<long long>(History::maxEntries)));
+                }
+                return Manager::history(limit, errmsg, result);
+            }
+        };
+
         class BackupInterface : public plugins::CommandLoader {
           protected:
             bool preLoad(string &errmsg, BSONObjBuilder &result) {
@@ -143,6 +189,7 @@ namespace mongo {
                     errmsg = "cannot load backup_plugin: enterprise backup library support not found";
                     return false;
                 }
+                Manager::resetThrottle();
                 return true;
             }
 
@@ -151,6 +198,7 @@ namespace mongo {
                 cmds.push_back(boost::make_shared<BackupStartCommand>());
                 cmds.push_back(boost::make_shared<BackupThrottleCommand>());
                 cmds.push_back(boost::make_shared<BackupStatusCommand>());
+                cmds.push_back(boost::make_shared<BackupHistoryCommand>());
                 return cmds;
             }
 
@@ -0,0 +1,202 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+// @file history.cpp
+/*======
+This file is part of Percona Server for MongoDB.
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+    Percona Server for MongoDB is free software: you can redistribute
+    it and/or modify it under the terms of the GNU Affero General
+    Public License, version 3, as published by the Free Software
+    Foundation.
+    Percona Server for MongoDB is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+    See the GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public
+    License along with Percona Server for MongoDB.  If not, see
+    <http://www.gnu.org/licenses/>.  
+======= */
+
+#include "mongo/pch.h"
+
+#include "history.h"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+#include "mongo/db/cmdline.h"
+#include "mongo/db/jsobj.h"
+#include "mongo/util/concurrency/mutex.h"
+#include "mongo/util/log.h"
+#include "mongo/util/net/sock.h"
+
+namespace mongo {
+
+    // ugh
+    extern string dbpath;
+
+    namespace backup {
+
+        SimpleMutex History::_mutex("backup history");
+        std::deque<BSONObj> History::_entries;
+        bool History::_loaded = false;
+        boost::filesystem::path History::_file;
+        string History::_nodeId;
+
+        void History::_locate() {
+            BSONElement logpath = CmdLine::getParsedOpts()["logpath"];
+            if (logpath.type() == String && !logpath.str().empty()) {
+                boost::filesystem::path p(logpath.str());
+                if (!p.has_root_directory()) {
+                    p = boost::filesystem::path(cmdLine.cwd) / p;
+                }
+                _file = p.string() + ".backup_history";
+                _nodeId = "";
+                return;
+            }
+
+            // Logging to stdout or syslog.  The dbpath gets backed up, so tag our entries
+            // with something a restored copy of the file won't match.
+            const boost::filesystem::path data = canonical(boost::filesystem::path(dbpath));
+            _file = data / "backup_plugin.history";
+            stringstream ss;
+            ss << getHostNameCached() << ":" << cmdLine.port;
+            struct stat st;
+            if (stat(data.c_str(), &st) == 0) {
+                ss << " inode " << st.st_ino;
+            }
+            _nodeId = ss.str();
+        }
+
+        void History::_load() {
+            // The file is just the entries' BSON, back to back.
+            _loaded = true;
+            _locate();
+            const boost::filesystem::path &path = _file;
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                int e = errno;
+                if (e != ENOENT) {
+                    LOG(0) << "could not open backup history " << path.generic_string()
+                           << ": " << strerror(e) << endl;
+                }
+                return;
+            }
+            std::string data;
+            char buf[4096];
+            ssize_t n;
+            while ((n = ::read(fd, buf, sizeof buf)) > 0) {
+                data.append(buf, n);
+            }
+            ::close(fd);
+
+            size_t off = 0;
+            int foreign = 0;
+            while (off + 4 <= data.size()) {
+                int size;
+                memcpy(&size, data.data() + off, sizeof size);
+                if (size < 5 || off + size > data.size()) {
+                    LOG(0) << "ignoring truncated backup history " << path.generic_string() << endl;
+                    break;
+                }
+                BSONObj entry(data.data() + off);
+                if (!entry.valid()) {
+                    LOG(0) << "ignoring truncated backup history " << path.generic_string() << endl;
+                    break;
+                }
+                off += size;
+                if (!_nodeId.empty() && entry["node"].str() != _nodeId) {
+                    ++foreign;
+                    continue;
+                }
+                _entries.push_back(entry.getOwned());
+            }
+            if (foreign > 0) {
+                LOG(0) << "ignoring " << foreign << " entries in backup history " << path.generic_string()
+                       << " that were copied from another node" << endl;
+            }
+            while (_entries.size() > maxEntries) {
+                _entries.pop_front();
+            }
+        }
+
+        void History::_save() {
+            // Write a new copy and rename it over the old one so a crash never leaves a torn file.
+            const boost::filesystem::path &path = _file;
+            const boost::filesystem::path tmp = path.string() + ".tmp";
+            int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+            if (fd < 0) {
+                int e = errno;
+                LOG(0) << "could not write backup history " << tmp.generic_string()
+                       << ": " << strerror(e) << endl;
+                return;
+            }
+            int e = 0;
+            for (std::deque<BSONObj>::const_iterator it = _entries.begin(); e == 0 && it != _entries.end(); ++it) {
+                const char *p = it->objdata();
+                size_t left = it->objsize();
+                while (left > 0) {
+                    ssize_t n = ::write(fd, p, left);
+                    if (n < 0) {
+                        e = errno;
+                        break;
+                    }
+                    p += n;
+                    left -= n;
+                }
+            }
+            if (e == 0 && ::fdatasync(fd) != 0) {
+                e = errno;
+            }
+            ::close(fd);
+            if (e == 0 && ::rename(tmp.c_str(), path.c_str()) != 0) {
+                e = errno;
+            }
+            if (e != 0) {
+                LOG(0) << "could not write backup history " << path.generic_string()
+                       << ": " << strerror(e) << endl;
+                ::unlink(tmp.c_str());
+            }
+        }
+
+        void History::add(const BSONObj &entry) {
+            SimpleMutex::scoped_lock lk(_mutex);
+            if (!_loaded) {
+                _load();
+            }
+            if (_nodeId.empty()) {
+                _entries.push_back(entry.getOwned());
+            }
+            else {
+                BSONObjBuilder b;
+                b.appendElements(entry);
+                b.append("node", _nodeId);
+                _entries.push_back(b.obj());
+            }
+            while (_entries.size() > maxEntries) {
+                _entries.pop_front();
+            }
+            _save();
+        }
+
+        void History::get(int limit, BSONArrayBuilder &b) {
+            SimpleMutex::scoped_lock lk(_mutex);
+            if (!_loaded) {
+                _load();
+            }
+            int n = 0;
+            for (std::deque<BSONObj>::const_reverse_iterator it = _entries.rbegin();
+                 it != _entries.rend() && (limit <= 0 || n < limit); ++it, ++n) {
+                b.append(*it);
+            }
+        }
+
+    } // namespace backup
+
+} // namespace mongo
@@ -0,0 +1,68 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// vim: ft=cpp:expandtab:ts=8:sw=4:softtabstop=4:
+// @file history.h
+
+/*======
+This file is part of Percona Server for MongoDB.
+Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
+    Percona Server for MongoDB is free software: you can redistribute
+    it and/or modify it under the terms of the GNU Affero General
+    Public License, version 3, as published by the Free Software
+    Foundation.
+    Percona Server for MongoDB is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+    See the GNU Affero General Public License for more details.
+    You should have received a copy of the GNU Affero General Public
+    License along with Percona Server for MongoDB.  If not, see
+    <http://www.gnu.org/licenses/>.  
+======= */
+
+#pragma once
+
+#include "mongo/pch.h"
+
+#include <deque>
+
+#include <boost/filesystem.hpp>
+
+#include "mongo/db/jsobj.h"
+#include "mongo/util/concurrency/mutex.h"
+
+namespace mongo {
+
+    namespace backup {
+
+        /**
+         * Summaries of finished backups, oldest first, kept in a file so they survive
+         * restarts.  Only the most recent maxEntries are kept.
+         *
+         * The file sits next to mongod's log file, outside anything a backup copies.  When
+         * mongod isn't logging to a file it falls back to the dbpath, and then entries are
+         * tagged with a node id that a restore doesn't carry over (host:port and the dbpath's
+         * inode); entries with another node's id are dropped on load.
+         */
+        class History : boost::noncopyable {
+            static SimpleMutex _mutex;
+            static std::deque<BSONObj> _entries;
+            static bool _loaded;
+            static boost::filesystem::path _file;
+            // Empty unless the file is in the dbpath.
+            static string _nodeId;
+
+            static void _locate();
+            static void _load();
+            static void _save();
+
+          public:
+            static const size_t maxEntries = 100;
+
+            static void add(const BSONObj &entry);
+
+            // Appends the most recent entries, newest first, to b.  limit <= 0 means all.
+            static void get(int limit, BSONArrayBuilder &b);
+        };
+
+    } // namespace backup
+
+} // namespace mongo
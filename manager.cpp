@@ -20,22 +20,35 @@ Copyright (c) 2006, 2015, Percona and/or its affiliates. All rights reserved.
 #include "mongo/pch.h"
 
 #include "manager.h"
+#include "history.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
 #include <iomanip>
+#include <limits>
+#include <map>
 #include <string>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <boost/filesystem.hpp>
 
 #include <backup.h>
 
 #include "mongo/db/client.h"
+#include "mongo/db/cmdline.h"
 #include "mongo/db/jsobj.h"
 #include "mongo/db/kill_current_op.h"
 #include "mongo/util/concurrency/mutex.h"
 #include "mongo/util/debug_util.h"
 #include "mongo/util/log.h"
+#include "mongo/util/mongoutils/str.h"
+#include "mongo/util/net/sock.h"
+#include "mongo/util/time_support.h"
+#include "mongo/util/timer.h"
 
 namespace mongo {
 
@@ -46,6 +59,13 @@ namespace mongo {
 
         SimpleMutex Manager::_currentMutex("backup manager");
         Manager *Manager::_currentManager = NULL;
+        SimpleMutex Manager::_throttleMutex("backup throttle");
+        long long Manager::_throttleBps = std::numeric_limits<long long>::max();
+
+        // Bounds for the dry run throughput probes, per device.
+        static const long long probeMaxBytes = 64LL << 20;
+        static const long long probeMaxMicros = 1000 * 1000;
+        static const size_t probeBufferSize = 1 << 20;
 
         static int c_poll_fun(float progress, const char *progress_string, void *poll_extra) {
             Manager *t = static_cast<Manager *>(poll_extra);
@@ -127,11 +147,15 @@ namespace mongo {
                 StringData currentFile(p);
                 if (currentFile == ".") {
                     // Just noting that we're copying the directory, don't need to save this progress.
+                    SimpleMutex::scoped_lock lk(_mutex);
+                    _noteFile("");
                     return;
                 }
 
                 {
                     SimpleMutex::scoped_lock lk(_mutex);
+                    _noteCopying(bytesDone);
+                    _noteFile(currentFile.toString());
                     _progress = progress;
                     _bytesDone = bytesDone;
                     _filesDone = filesDone - 1;  // number reported is the current file number, it's not done yet.
@@ -175,11 +199,11 @@ namespace mongo {
                     return;
                 }
 
-                // TODO: maybe report this somewhere?
-                (void) sleepTime;
-
                 {
                     SimpleMutex::scoped_lock lk(_mutex);
+                    _noteCopying(bytesDone);
+                    _throttledSecs += sleepTime;
+                    _timedFileBytes = currentTotal;
                     _progress = progress;
                     _bytesDone = bytesDone;
                     _filesDone = filesDone - 1;  // number reported is the current file number, it's not done yet.
@@ -211,6 +235,8 @@ namespace mongo {
 
                 {
                     SimpleMutex::scoped_lock lk(_mutex);
+                    _noteCopying(bytesDone);
+                    _timedFileBytes = currentTotal;
                     _progress = progress;
                     _bytesDone = bytesDone;
                     _filesDone = filesDone - 1;  // number reported is the current file number, it's not done yet.
@@ -222,6 +248,93 @@ namespace mongo {
             }
         }
 
+        void Manager::Progress::begin() {
+            SimpleMutex::scoped_lock lk(_mutex);
+            _startMicros = curTimeMicros64();
+        }
+
+        void Manager::Progress::_noteCopying(long long bytesDone) {
+            // Called with _mutex held.  Peak throughput is taken over windows of at least a
+            // second, individual polls are too close together to mean much.
+            unsigned long long now = curTimeMicros64();
+            if (_copyStartMicros == 0) {
+                _copyStartMicros = now;
+                _sampleMicros = now;
+                _sampleBytes = bytesDone;
+                return;
+            }
+            if (now - _sampleMicros >= 1000 * 1000) {
+                double bps = (bytesDone - _sampleBytes) * 1000000.0 / (now - _sampleMicros);
+                _peakBps = std::max(_peakBps, bps);
+                _sampleMicros = now;
+                _sampleBytes = bytesDone;
+            }
+        }
+
+        void Manager::Progress::_noteFile(const string &source) {
+            // Called with _mutex held.  Finishes timing the previous file, if any.
+            unsigned long long now = curTimeMicros64();
+            if (!_timedFile.empty()) {
+                FileTime ft(_timedFile, _timedFileBytes, now - _timedFileStartMicros);
+                std::vector<FileTime>::iterator it = _slowestFiles.begin();
+                while (it != _slowestFiles.end() && it->micros >= ft.micros) {
+                    ++it;
+                }
+                _slowestFiles.insert(it, ft);
+                if (_slowestFiles.size() > maxSlowestFiles) {
+                    _slowestFiles.pop_back();
+                }
+            }
+            _timedFile = source;
+            _timedFileBytes = 0;
+            _timedFileStartMicros = now;
+        }
+
+        void Manager::Progress::summarize(bool completed, BSONObjBuilder &b) {
+            SimpleMutex::scoped_lock lk(_mutex);
+            _noteFile("");
+            unsigned long long now = curTimeMicros64();
+            unsigned long long copyStart = _copyStartMicros == 0 ? now : _copyStartMicros;
+            double copySecs = (now - copyStart) / 1000000.0;
+            long long bytes = _bytesDone;
+            if (completed && _currentTotal > _currentDone) {
+                // The last poll came before the last file finished copying.
+                bytes += _currentTotal - _currentDone;
+            }
+            if (_peakBps == 0.0 && _copyStartMicros != 0 && now > _sampleMicros) {
+                // Never got a full window, the whole copy is the best we have.
+                _peakBps = (bytes - _sampleBytes) * 1000000.0 / (now - _sampleMicros);
+            }
+
+            b.append("bytes", bytes);
+            b.append("files", completed ? _filesTotal : _filesDone);
+            {
+                BSONObjBuilder sb(b.subobjStart("seconds"));
+                sb.append("total", (now - _startMicros) / 1000000.0);
+                sb.append("preparing", (copyStart - _startMicros) / 1000000.0);
+                sb.append("copying", copySecs);
+                sb.append("throttled", _throttledSecs);
+                sb.doneFast();
+            }
+            {
+                BSONObjBuilder tb(b.subobjStart("bytesPerSec"));
+                tb.append("average", copySecs > 0 ? bytes / copySecs : 0.0);
+                tb.append("peak", _peakBps);
+                tb.doneFast();
+            }
+            {
+                BSONArrayBuilder fab(b.subarrayStart("slowestFiles"));
+                for (std::vector<FileTime>::const_iterator it = _slowestFiles.begin(); it != _slowestFiles.end(); ++it) {
+                    BSONObjBuilder fb(fab.subobjStart());
+                    fb.append("source", it->source);
+                    fb.append("bytes", it->bytes);
+                    fb.append("seconds", it->micros / 1000000.0);
+                    fb.doneFast();
+                }
+                fab.doneFast();
+            }
+        }
+
         void Manager::Progress::get(BSONObjBuilder &b) const {
             SimpleMutex::scoped_lock lk(_mutex);
             b.append("percent", _progress * 100.0);
@@ -325,7 +438,60 @@ namespace mongo {
             return sources;
         }
 
+        std::vector<string> Manager::_getDestDirs(const std::vector<string> &sources,
+                                                  const string &dest) {
+            std::vector<string> dests;
+            if (sources.size() == 1) {
+                dests.push_back(dest);
+            } else {
+                const boost::filesystem::path dest_path = dest;
+                dests.push_back((dest_path / "data").generic_string());
+                dests.push_back((dest_path / "log").generic_string());
+            }
+            return dests;
+        }
+
         bool Manager::start(const string &dest, string &errmsg, BSONObjBuilder &result) {
+            const Date_t startDate = jsTime();
+            _progress.begin();
+
+            // Every attempt goes in the history, including ones that fail before the backup
+            // library gets going.
+            bool ok;
+            try {
+                ok = _start(dest, errmsg, result);
+            } catch (const boost::filesystem::filesystem_error &e) {
+                errmsg = string("ERROR: Hot Backup could not resolve source directories: ") + e.what();
+                ok = false;
+            }
+
+            BSONObjBuilder hb;
+            const string host = mongoutils::str::stream() << getHostNameCached() << ":" << cmdLine.port;
+            hb.append("host", host);
+            hb.append("dest", dest);
+            hb.appendDate("start", startDate);
+            hb.appendDate("end", jsTime());
+            hb.append("ok", ok);
+            _progress.summarize(ok, hb);
+            if (!ok) {
+                BSONObjBuilder eb(hb.subobjStart("error"));
+                if (!_error.empty()) {
+                    _error.get(eb);
+                }
+                else {
+                    eb.append("message", errmsg);
+                }
+                eb.doneFast();
+            }
+            if (!_killedString.empty()) {
+                hb.append("reason", _killedString);
+            }
+            History::add(hb.obj());
+
+            return ok;
+        }
+
+        bool Manager::_start(const string &dest, string &errmsg, BSONObjBuilder &result) {
             // We want the fully resolved path, rid of '..' and symlinks,
             // for both the data dir and the log dir (if it exists).
             const boost::filesystem::path data_src = canonical(boost::filesystem::path(dbpath));
@@ -334,20 +500,15 @@ namespace mongo {
             verify(!sources.empty());
             verify(sources.size() <= 2);
 
-            std::vector<string> dests;
+            const std::vector<string> dests = _getDestDirs(sources, dest);
 
-            // Fill in dests vector based on sources.
-            if (sources.size() == 1) {
-                dests.push_back(dest);
-            } else {
-                const boost::filesystem::path dest_path = dest;
+            if (sources.size() > 1) {
                 // If we have two source dirs, they will be dbpath and
                 // logDir, we need to create subdirectories of dest.
-                const boost::filesystem::path data_dest = dest_path / "data";
-                const boost::filesystem::path log_dest = dest_path / "log";
                 try {
-                    boost::filesystem::create_directory(data_dest);
-                    boost::filesystem::create_directory(log_dest);
+                    for (size_t i = 0; i < dests.size(); ++i) {
+                        boost::filesystem::create_directory(boost::filesystem::path(dests[i]));
+                    }
                 } catch (const boost::filesystem::filesystem_error &e) {
                     DEV {
                         LOG(0) << "ERROR: Hot Backup could not create backup subdirectories:"
@@ -357,9 +518,6 @@ namespace mongo {
                     errmsg = "ERROR: Hot Backup could not create backup subdirectories.";
                     return false;
                 }
-
-                dests.push_back(data_dest.generic_string());
-                dests.push_back(log_dest.generic_string());
             }
             const char *source_dirs[2];
             const char *dest_dirs[2];
@@ -394,6 +552,297 @@ namespace mongo {
             return ok;
         }
 
+        namespace {
+
+            struct SourceFile {
+                boost::filesystem::path path;
+                uintmax_t size;
+                SourceFile(const boost::filesystem::path &p, uintmax_t sz) : path(p), size(sz) {}
+                bool operator<(const SourceFile &other) const {
+                    // Largest first, so the read probe sees long sequential runs.
+                    return size > other.size;
+                }
+            };
+
+            double bytesPerSec(long long bytes, long long micros) {
+                if (bytes <= 0 || micros <= 0) {
+                    return 0.0;
+                }
+                return bytes * 1000000.0 / micros;
+            }
+
+            // Reads from files for at most probeMaxBytes / probeMaxMicros, returns bytes/sec.
+            // Reads use O_DIRECT so the server's hot files, which are likely cached, don't
+            // make the device look faster than it is (and we don't evict them either).  If
+            // the filesystem refuses O_DIRECT, falls back to the page cache and sets cached.
+            double probeRead(const std::vector<SourceFile> &files, bool &cached) {
+                cached = false;
+                void *mem;
+                if (posix_memalign(&mem, 4096, probeBufferSize) != 0) {
+                    cached = true;
+                    return 0.0;
+                }
+                char *buf = static_cast<char *>(mem);
+                long long bytesRead = 0;
+                Timer t;
+                for (std::vector<SourceFile>::const_iterator it = files.begin();
+                     it != files.end() && bytesRead < probeMaxBytes && t.micros() < probeMaxMicros;
+                     ++it) {
+                    int fd = ::open(it->path.c_str(), O_RDONLY | O_DIRECT);
+                    if (fd < 0 && errno == EINVAL) {
+                        fd = ::open(it->path.c_str(), O_RDONLY);
+                        if (fd >= 0) {
+                            cached = true;
+                        }
+                    }
+                    if (fd < 0) {
+                        // Files come and go underneath a live server, just try the next one.
+                        continue;
+                    }
+                    while (bytesRead < probeMaxBytes && t.micros() < probeMaxMicros) {
+                        ssize_t n = ::read(fd, buf, probeBufferSize);
+                        if (n <= 0) {
+                            break;
+                        }
+                        bytesRead += n;
+                    }
+                    ::close(fd);
+                }
+                long long micros = t.micros();
+                free(mem);
+                return bytesPerSec(bytesRead, micros);
+            }
+
+            // Writes and syncs a uniquely named scratch file in dir, then removes it.  Returns
+            // bytes/sec, or -1 with errmsg set if dir is not writable.
+            double probeWrite(const boost::filesystem::path &dir, long long maxBytes, string &errmsg) {
+                const string probeTemplate = (dir / "backup_dryrun_probe.XXXXXX").string();
+                std::vector<char> probeName(probeTemplate.begin(), probeTemplate.end());
+                probeName.push_back('\0');
+                int fd = mkstemp(&probeName[0]);
+                if (fd < 0) {
+                    int e = errno;
+                    if (e == EEXIST) {
+                        errmsg = "could not pick a unique probe file name in destination directory '" + dir.generic_string() + "'";
+                    } else {
+                        errmsg = "cannot write to destination directory '" + dir.generic_string() + "': " + strerror(e);
+                    }
+                    return -1.0;
+                }
+                const char *probe = &probeName[0];
+                std::vector<char> buf(probeBufferSize);
+                for (size_t i = 0; i < buf.size(); ++i) {
+                    buf[i] = static_cast<char>(i);
+                }
+                long long bytesWritten = 0;
+                int e = 0;
+                Timer t;
+                while (bytesWritten < maxBytes && t.micros() < probeMaxMicros) {
+                    size_t len = std::min(static_cast<long long>(buf.size()), maxBytes - bytesWritten);
+                    ssize_t n = ::write(fd, &buf[0], len);
+                    if (n < 0) {
+                        e = errno;
+                        break;
+                    }
+                    bytesWritten += n;
+                }
+                if (e == 0 && ::fdatasync(fd) != 0) {
+                    e = errno;
+                }
+                long long micros = t.micros();
+                ::close(fd);
+                ::unlink(probe);
+                if (e != 0) {
+                    errmsg = "error writing to destination directory '" + dir.generic_string() + "': " + strerror(e);
+                    return -1.0;
+                }
+                return bytesPerSec(bytesWritten, micros);
+            }
+
+        } // namespace
+
+        bool Manager::dryRun(const string &dest, string &errmsg, BSONObjBuilder &result) {
+            {
+                // The probes would compete with the running backup for the same devices, and
+                // a real backupStart would fail right now anyway.
+                SimpleMutex::scoped_lock lk(_currentMutex);
+                if (_currentManager != NULL) {
+                    errmsg = "a backup is already running";
+                    return false;
+                }
+            }
+
+            const boost::filesystem::path data_src = canonical(boost::filesystem::path(dbpath));
+            const boost::filesystem::path log_src = canonical(boost::filesystem::path(cmdLine.logDir));
+            const std::vector<string> sources = _getSourceDirs(data_src, log_src);
+            verify(!sources.empty());
+            verify(sources.size() <= 2);
+            const std::vector<string> dests = _getDestDirs(sources, dest);
+
+            const boost::filesystem::path dest_path = dest;
+            boost::system::error_code ec;
+            const boost::filesystem::file_status destStatus = boost::filesystem::status(dest_path, ec);
+            if (ec) {
+                errmsg = "cannot access destination directory '" + dest + "': " + ec.message();
+                return false;
+            }
+            if (!boost::filesystem::is_directory(destStatus)) {
+                errmsg = "destination '" + dest + "' is not a directory";
+                return false;
+            }
+            const boost::filesystem::space_info space = boost::filesystem::space(dest_path, ec);
+            if (ec) {
+                errmsg = "cannot stat destination directory '" + dest + "': " + ec.message();
+                return false;
+            }
+
+            // Walk each source, grouping files by the device they live on.
+            std::vector<long long> sourceBytes(sources.size(), 0);
+            std::vector<int> sourceFiles(sources.size(), 0);
+            std::vector<dev_t> sourceDevs(sources.size());
+            std::map<dev_t, std::vector<SourceFile> > deviceFiles;
+            for (size_t i = 0; i < sources.size(); ++i) {
+                struct stat st;
+                if (stat(sources[i].c_str(), &st) != 0) {
+                    int e = errno;
+                    errmsg = "cannot stat source directory '" + sources[i] + "': " + strerror(e);
+                    return false;
+                }
+                sourceDevs[i] = st.st_dev;
+                std::vector<SourceFile> &files = deviceFiles[st.st_dev];
+                try {
+                    for (boost::filesystem::recursive_directory_iterator it(sources[i]), end;
+                         it != end; ++it) {
+                        _killedString = killCurrentOp.checkForInterruptNoAssert(_c);
+                        if (!_killedString.empty()) {
+                            errmsg = "backup dry run interrupted";
+                            result.append("reason", _killedString);
+                            return false;
+                        }
+                        if (!boost::filesystem::is_regular_file(it->symlink_status())) {
+                            continue;
+                        }
+                        uintmax_t sz = boost::filesystem::file_size(it->path(), ec);
+                        if (ec) {
+                            // Removed since we listed it.
+                            continue;
+                        }
+                        sourceBytes[i] += sz;
+                        sourceFiles[i]++;
+                        files.push_back(SourceFile(it->path(), sz));
+                    }
+                } catch (const boost::filesystem::filesystem_error &e) {
+                    errmsg = string("error scanning source directory '") + sources[i] + "': " + e.what();
+                    return false;
+                }
+            }
+
+            long long totalBytes = 0;
+            int totalFiles = 0;
+            for (size_t i = 0; i < sources.size(); ++i) {
+                totalBytes += sourceBytes[i];
+                totalFiles += sourceFiles[i];
+            }
+
+            std::map<dev_t, double> readBps;
+            std::map<dev_t, bool> readCached;
+            bool optimistic = false;
+            for (std::map<dev_t, std::vector<SourceFile> >::iterator it = deviceFiles.begin();
+                 it != deviceFiles.end(); ++it) {
+                std::sort(it->second.begin(), it->second.end());
+                bool cached;
+                readBps[it->first] = probeRead(it->second, cached);
+                readCached[it->first] = cached;
+                optimistic = optimistic || cached;
+            }
+            // Never write more than half of what's left on the destination.
+            const long long writeMax = std::min(probeMaxBytes, static_cast<long long>(space.available / 2));
+            const double writeBps = probeWrite(dest_path, writeMax, errmsg);
+            if (writeBps < 0) {
+                return false;
+            }
+
+            long long throttleBps;
+            {
+                SimpleMutex::scoped_lock lk(_throttleMutex);
+                throttleBps = _throttleBps;
+            }
+
+            // Sources are copied one after another, each limited by the slowest of its
+            // read device, the destination, and the throttle.  If any of those is zero, say
+            // which one instead of estimating.
+            double estimatedSecs = 0.0;
+            string estimateError;
+            if (totalBytes > 0 && throttleBps == 0) {
+                estimateError = "backup is throttled to 0 bytes/sec, it would never finish";
+            }
+            else if (totalBytes > 0 && writeBps <= 0.0) {
+                estimateError = writeMax <= 0
+                        ? "not enough free space at the destination to probe write throughput"
+                        : "write probe of the destination copied no data";
+            }
+            for (size_t i = 0; estimateError.empty() && i < sources.size(); ++i) {
+                if (sourceBytes[i] == 0) {
+                    continue;
+                }
+                double rate = readBps[sourceDevs[i]];
+                if (rate <= 0.0) {
+                    estimateError = "read probe of source '" + sources[i] + "' read no data";
+                    break;
+                }
+                rate = std::min(rate, writeBps);
+                rate = std::min(rate, static_cast<double>(throttleBps));
+                estimatedSecs += sourceBytes[i] / rate;
+            }
+
+            result.append("dryRun", true);
+            {
+                BSONArrayBuilder sab(result.subarrayStart("sources"));
+                for (size_t i = 0; i < sources.size(); ++i) {
+                    BSONObjBuilder sb(sab.subobjStart());
+                    sb.append("source", sources[i]);
+                    sb.append("dest", dests[i]);
+                    sb.append("bytes", sourceBytes[i]);
+                    sb.append("files", sourceFiles[i]);
+                    sb.append("readBytesPerSec", readBps[sourceDevs[i]]);
+                    sb.append("readCached", readCached[sourceDevs[i]]);
+                    sb.doneFast();
+                }
+                sab.doneFast();
+            }
+            result.append("bytes", totalBytes);
+            result.append("files", totalFiles);
+            {
+                BSONObjBuilder db(result.subobjStart("destination"));
+                db.append("path", dest);
+                db.append("capacity", static_cast<long long>(space.capacity));
+                db.append("available", static_cast<long long>(space.available));
+                db.append("sufficientSpace", static_cast<uintmax_t>(totalBytes) <= space.available);
+                db.append("writeBytesPerSec", writeBps);
+                db.doneFast();
+            }
+            if (throttleBps != std::numeric_limits<long long>::max()) {
+                result.append("throttle", throttleBps);
+            }
+            if (estimateError.empty()) {
+                result.append("estimatedSeconds", estimatedSecs);
+            }
+            else {
+                result.append("estimateError", estimateError);
+            }
+            // Reads that went through the page cache may have measured memory, not disk.
+            result.append("estimateOptimistic", optimistic);
+            return true;
+        }
+
+        void Manager::resetThrottle() {
+            // The library's throttle is process-wide and outlives a plugin reload, so put it
+            // back in step with _throttleBps.
+            SimpleMutex::scoped_lock lk(_throttleMutex);
+            _throttleBps = std::numeric_limits<long long>::max();
+            tokubackup_throttle_backup(_throttleBps);
+        }
+
         bool Manager::throttle(long long bps, string &errmsg, BSONObjBuilder &result) {
             if (bps < 0) {
                 errmsg = "backupThrottle argument cannot be negative";
@@ -401,6 +850,10 @@ namespace mongo {
             }
             DEV LOG(0) << "Throttling backup to " << bps << endl;
             tokubackup_throttle_backup(bps);
+            {
+                SimpleMutex::scoped_lock lk(_throttleMutex);
+                _throttleBps = bps;
+            }
             return true;
         }
 
@@ -414,6 +867,13 @@ namespace mongo {
             return true;
         }
 
+        bool Manager::history(int limit, string &errmsg, BSONObjBuilder &result) {
+            BSONArrayBuilder ab(result.subarrayStart("history"));
+            History::get(limit, ab);
+            ab.doneFast();
+            return true;
+        }
+
     } // namespace backup
 
 } // namespace mongo
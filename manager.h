@@ -46,6 +46,28 @@ namespace mongo {
                 long long _currentTotal;
                 string _currentSource;
                 string _currentDest;
+
+                // Timings kept for the backup history, all from curTimeMicros64().
+                struct FileTime {
+                    string source;
+                    long long bytes;
+                    unsigned long long micros;
+                    FileTime(const string &s, long long b, unsigned long long m) : source(s), bytes(b), micros(m) {}
+                };
+                static const size_t maxSlowestFiles = 5;
+                unsigned long long _startMicros;
+                unsigned long long _copyStartMicros;
+                double _throttledSecs;
+                unsigned long long _sampleMicros;
+                long long _sampleBytes;
+                double _peakBps;
+                string _timedFile;
+                long long _timedFileBytes;
+                unsigned long long _timedFileStartMicros;
+                std::vector<FileTime> _slowestFiles;
+
+                void _noteCopying(long long bytesDone);
+                void _noteFile(const string &source);
               public:
                 Progress() :
                         _mutex("backup progress"),
@@ -56,10 +78,23 @@ namespace mongo {
                         _currentDone(0),
                         _currentTotal(0),
                         _currentSource(),
-                        _currentDest()
+                        _currentDest(),
+                        _startMicros(0),
+                        _copyStartMicros(0),
+                        _throttledSecs(0.0),
+                        _sampleMicros(0),
+                        _sampleBytes(0),
+                        _peakBps(0.0),
+                        _timedFile(),
+                        _timedFileBytes(0),
+                        _timedFileStartMicros(0),
+                        _slowestFiles()
                 {}
+                void begin();
                 void parse(float progress, const char *progress_string);
                 void get(BSONObjBuilder &b) const;
+                // Closes out timing and appends the history summary for a finished backup.
+                void summarize(bool completed, BSONObjBuilder &b);
             } _progress;
 
             struct Error {
@@ -75,8 +110,16 @@ namespace mongo {
             static SimpleMutex _currentMutex;
             static Manager *_currentManager;
 
+            // Last rate passed to backupThrottle, so dry runs can predict duration.
+            static SimpleMutex _throttleMutex;
+            static long long _throttleBps;
+
             static std::vector<string> _getSourceDirs(const boost::filesystem::path &data_src,
                                                       const boost::filesystem::path &log_src);
+            static std::vector<string> _getDestDirs(const std::vector<string> &sources,
+                                                    const string &dest);
+
+            bool _start(const string &dest, string &errmsg, BSONObjBuilder &result);
 
           public:
             explicit Manager(Client &c) : _c(c), _killedString(), _progress(), _error() {}
@@ -88,9 +131,19 @@ namespace mongo {
 
             bool start(const string &dest, string &errmsg, BSONObjBuilder &result);
 
+            // Sizes up a backup to dest without copying anything: sums the source files,
+            // checks free space at dest, probes device throughput for a bounded time, and
+            // estimates duration at the current throttle.
+            bool dryRun(const string &dest, string &errmsg, BSONObjBuilder &result);
+
             static bool throttle(long long bps, string &errmsg, BSONObjBuilder &result);
 
+            // Removes any throttle on the backup library, called when the plugin loads.
+            static void resetThrottle();
+
             static bool status(string &errmsg, BSONObjBuilder &result);
+
+            static bool history(int limit, string &errmsg, BSONObjBuilder &result);
         };
 
     } // namespace backup